@@ -214,6 +214,13 @@ Software Foundation, 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
            it is not used.
         2. Added color to console output
         3. Added 'table' command, which is a table like display
+   3.0 2026-10-17
+        1. Reads index file version 10, as well as version 4: lazily
+           loaded tables, mapped native-order indexes, front-coded
+           word tables and both reference list codecs.  biblook 2.11
+           and earlier can't read version 10.
+        2. Searches collections made by bibindex -r, and gzip'ed bib
+           files.
 \* ================================================================= */
 
 #include "biblook.h"
@@ -352,36 +359,128 @@ void *safemalloc(unsigned howmuch, const char *msg1, const char *msg2)
 }
 
 /* ----------------------------------------------------------------- *\
-|  void ConvertToHostOrder(int n, int s, void *xx)
+|  void SwapBytes(size_t n, size_t s, void *xx)
+|  void ConvertToHostOrder(size_t n, size_t s, void *xx)
 |
-|  Convert n elements of size s to host-byteorder
+|  Reverse the bytes of n elements of size s, and convert n elements
+|  of size s to host-byteorder.  An index file is in network byte
+|  order, unless it was written with bibindex --native, in the byte
+|  order of the machine that wrote it; fileswap says whether that's
+|  the other way round from the host's.
 \* ----------------------------------------------------------------- */
+int fileswap = 0;                       /* of the index file being read */
+int filealigned = 0;
+
+static void SwapBytes(size_t n, size_t s, void *xx)
+{
+    unsigned char *p = (unsigned char *)xx;
+    unsigned char t;
+    size_t i;
+
+    for (; n > 0; n--, p += s) {
+        for (i = 0; i < s / 2; i++) {
+            t = p[i];
+            p[i] = p[s - 1 - i];
+            p[s - 1 - i] = t;
+        }
+    }
+}
+
 static void ConvertToHostOrder(size_t n, size_t s, void *xx)
 {
-    uint16 *x = (uint16 *)xx;
-    uint32 *y = (uint32 *)xx;
+    if (fileswap)
+        SwapBytes(n, s, xx);
+}
 
-    if (s == sizeof(uint16)) {
-        while (n-- > 0) {
-            *x = ntohs(*x);
-            x++;
-        }
-    } else {                            /* assume s == sizeof(uint32) */
-        while (n-- > 0) {
-            *y = ntohl(*y);
-            y++;
+/* ----------------------------------------------------------------- *\
+|  void ReadFixed(FILE *ifp, void *buf, size_t s, size_t n)
+|
+|  Read n numbers of size s into buf, in host order.  In a native
+|  index, they are aligned to their size in the file.
+\* ----------------------------------------------------------------- */
+void ReadFixed(FILE *ifp, void *buf, size_t s, size_t n)
+{
+    long pad;
+
+    if (filealigned && (pad = ftell(ifp) % (long)s) &&
+            (fseek(ifp, (long)s - pad, SEEK_CUR) != 0))
+        pdie("Error reading", bixfile);
+    safefread(buf, s, n, ifp);
+    ConvertToHostOrder(n, s, buf);
+}
+
+/* ----------------------------------------------------------------- *\
+|  Index_t ReadCount(FILE *ifp, size_t old)
+|
+|  Read a count from the index file.  Version 4 files have it in old
+|  bytes (1, 2 or 4), later ones in as many bytes as it needs, seven
+|  bits at a time, low to high, the way the references are compressed.
+\* ----------------------------------------------------------------- */
+int fileversion = FILE_VERSION;         /* of the index file being read */
+
+Index_t ReadCount(FILE *ifp, size_t old)
+{
+    Index_t n = 0;
+    uint16 n16;
+    uint8 n8;
+    int ch, shift;
+
+    if (fileversion < 5) {
+        if (old == sizeof(uint8)) {
+            safefread((void *)&n8, sizeof(uint8), 1, ifp);
+            return n8;
+        } else if (old == sizeof(uint16)) {
+            safefread((void *)&n16, sizeof(uint16), 1, ifp);
+            return ntohs(n16);
         }
+        safefread((void *)&n, sizeof(Index_t), 1, ifp);
+        return ntohl(n);
     }
+
+    shift = 0;
+    do {
+        if (((ch = getc(ifp)) == EOF) || (shift > 28))
+            die("Index file is corrupt", "(bad count).");
+        n |= (Index_t)(ch & ~CHAR_HIGHBIT) << shift;
+        shift += CHAR_BIT - 1;
+    } while (ch & CHAR_HIGHBIT);
+    return n;
 }
 
 /* ----------------------------------------------------------------- *\
-|  void UncompressRefs(Index_t *list, char *p, Index_t length)
+|  void ReadOffsets(FILE *ifp, Off_t *offsets, Index_t n)
 |
-|  Uncompress a sequence of Index_t.  See bibindex for algorithm.
+|  Read n offsets into the bib file, four bytes each in version 4
+|  files, and eight in later ones.
 \* ----------------------------------------------------------------- */
-void UncompressRefs(Index_t *list, char *p, Index_t length)
+void ReadOffsets(FILE *ifp, Off_t *offsets, Index_t n)
+{
+    int32 *narrow;
+    Index_t k;
+
+    if (fileversion >= 5) {
+        ReadFixed(ifp, (void *)offsets, sizeof(Off_t), n);
+        return;
+    }
+
+    narrow = (int32 *)safemalloc(n * sizeof(int32),
+        "Can't create offset table", "");
+    safefread((void *)narrow, sizeof(int32), n, ifp);
+    ConvertToHostOrder(n, sizeof(int32), narrow);
+    for (k = 0; k < n; k++)
+        offsets[k] = narrow[k];
+    free(narrow);
+}
+
+/* ----------------------------------------------------------------- *\
+|  char *UncompressRefs(Index_t *list, char *p, Index_t length,
+|                       Index_t prev)
+|
+|  Uncompress a sequence of Index_t, which follow prev, and return
+|  where it ends.  See bibindex for algorithm.
+\* ----------------------------------------------------------------- */
+char *UncompressRefs(Index_t *list, char *p, Index_t length, Index_t prev)
 {
-    Index_t prevref = (Index_t)-1;
     Index_t diff;
     char bits, highbit;
     int shift;
@@ -396,9 +495,114 @@ void UncompressRefs(Index_t *list, char *p, Index_t length)
             diff |= bits << shift;
             shift += CHAR_BIT - 1;
         } while (highbit);
-        *list = prevref + diff;
-        prevref = *list++;
+        *list = prev + diff;
+        prev = *list++;
+    }
+    return p;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void InitStreamTables(VOID)
+|  char *UnstreamBlock(Index_t *list, Index_t prev, char *p, char *end)
+|
+|  Decode a block of REFBLOCK references, which follow prev, written
+|  with the stream codec from p to end, and return end, or NULL if
+|  the block doesn't fill it.  See StreamBlock() in bibindex for the
+|  format, and for the tables InitStreamTables() sets up.
+\* ----------------------------------------------------------------- */
+static const int streamwidth[4] = {0, 1, 2, 4};
+static unsigned char streamlength[256];
+#if __SSSE3__
+static unsigned char streamshuffle[256][16];
+#else /* NOT __SSSE3__ */
+static const Index_t streammask[4] = {0, 0xff, 0xffff, 0xffffffff};
+#endif /* __SSSE3__ */
+
+void InitStreamTables(VOID)
+{
+    int c, i, k, n;
+
+    for (c = 0; c < 256; c++) {
+        for (i = k = 0; i < 4; i++) {
+            n = streamwidth[(c >> (2 * i)) & 3];
+#if __SSSE3__
+            {
+                int j;
+
+                for (j = 0; j < 4; j++)
+                    streamshuffle[c][4 * i + j] =
+                        (unsigned char)((j < n) ? k + j : 0x80);
+            }
+#endif /* __SSSE3__ */
+            k += n;
+        }
+        streamlength[c] = (unsigned char)k;
+    }
+}
+
+char *UnstreamBlock(Index_t *list, Index_t prev, char *p, char *end)
+{
+    unsigned char *ctrl = (unsigned char *)p;
+    unsigned char *q = ctrl + REFBLOCK / 4;
+    unsigned char *qend = (unsigned char *)end;
+    long length = 0;
+    int g;
+
+    if (end - p < REFBLOCK / 4)
+        return NULL;
+    for (g = 0; g < REFBLOCK / 4; g++)
+        length += streamlength[ctrl[g]];
+    if (length != qend - q)
+        return NULL;
+
+#if __SSSE3__
+    {
+        __m128i v, last = _mm_set1_epi32((int)prev);
+        __m128i one = _mm_set1_epi32(1);
+        unsigned char spare[32];        /* the last few bytes, padded */
+        int padded = 0;
+
+        for (g = 0; g < REFBLOCK / 4; g++) {
+            if (!padded && (qend - q < 16)) {
+                bzero(spare, sizeof spare);
+                memcpy(spare, q, qend - q);
+                q = spare;
+                padded = 1;
+            }
+            v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)q),
+                _mm_loadu_si128((const __m128i *)streamshuffle[ctrl[g]]));
+            v = _mm_add_epi32(v, one);
+            v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+            v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+            v = _mm_add_epi32(v, last);
+            _mm_storeu_si128((__m128i *)(list + 4 * g), v);
+            last = _mm_shuffle_epi32(v, 0xff);
+            q += streamlength[ctrl[g]];
+        }
     }
+#else /* NOT __SSSE3__ */
+    {
+        Index_t diff;
+        int i, k, code;
+
+        for (g = 0; g < REFBLOCK / 4; g++) {
+            for (i = 0; i < 4; i++) {
+                code = (ctrl[g] >> (2 * i)) & 3;
+                if (qend - q >= 4) {
+                    diff = ((Index_t)q[0] | ((Index_t)q[1] << 8) |
+                        ((Index_t)q[2] << 16) | ((Index_t)q[3] << 24)) &
+                        streammask[code];
+                } else {
+                    for (diff = 0, k = streamwidth[code]; k > 0; k--)
+                        diff = (diff << CHAR_BIT) | q[k - 1];
+                }
+                q += streamwidth[code];
+                prev = list[4 * g + i] = prev + diff + 1;
+            }
+        }
+    }
+#endif /* __SSSE3__ */
+    return end;
 }
 
 void CopyrightBanner(void)
@@ -949,12 +1153,13 @@ static void History_swallow_last(void)
 
 #define CACHESIZE 8192
 
-typedef struct {
+typedef struct CachedList {
+    FILE *fp;                           /* the index file it's from */
     long offset;                        /* offset into index file  */
-    Index_s length;                     /* length of the list	   */
-    Index_s bytes;                      /* length when compressed  */
-    char *list;                         /* compressed list or NULL */
+    Index_t bytes;                      /* length when compressed  */
+    char *list;                         /* compressed list */
     int rank;                           /* back pointer into cache */
+    struct CachedList *next;            /* in its hash chain */
 } CachedList;
 
 typedef struct {
@@ -963,6 +1168,7 @@ typedef struct {
 } CacheElement;
 
 CacheElement cache[CACHESIZE];
+CachedList *cachehash[CACHESIZE];       /* the cached lists by offset */
 long curstamp;                          /* current "time stamp" */
 int cachenum;                           /* number of elements in the cache */
 
@@ -978,35 +1184,11 @@ void InitCache(VOID)
     for (i = 0; i < CACHESIZE; i++) {
         cache[i].stamp = -1;
         cache[i].clist = NULL;
+        cachehash[i] = NULL;
     }
     curstamp = 0;
 }
 
-/* ----------------------------------------------------------------- *\
-|  void InitCachedList(CachedList *clist, FILE *ifp)
-|
-|  Initialize the cached list.  Read the lengths of the list from the
-|  file, record the position of the list within the file, and skip
-|  over the list itself.
-\* ----------------------------------------------------------------- */
-void InitCachedList(CachedList *clist, FILE *ifp)
-{
-    Index_s num;
-
-    clist->list = NULL;
-
-    safefread((void *)&num, sizeof(Index_s), 1, ifp);
-    ConvertToHostOrder(1, sizeof(Index_s), &num);
-    clist->length = num;
-    safefread((void *)&num, sizeof(Index_s), 1, ifp);
-    ConvertToHostOrder(1, sizeof(Index_s), &num);
-    clist->bytes = num;
-
-    clist->offset = ftell(ifp);
-    if (fseek(ifp, (long)num, SEEK_CUR) != 0)
-        pdie("Error reading", bixfile);
-}
-
 /* ----------------------------------------------------------------- *\
 |  void FreeCache(void)
 |
@@ -1016,8 +1198,12 @@ void FreeCache(VOID)
 {
     int i;
 
-    for (i = 0; i < cachenum; i++)
+    for (i = 0; i < cachenum; i++) {
         free(cache[i].clist->list);
+        free(cache[i].clist);
+    }
+    cachenum = 0;
+    InitCache();
 }
 
 /* ----------------------------------------------------------------- *\
@@ -1070,26 +1256,43 @@ void HeapBubble(int which)
 }
 
 /* ----------------------------------------------------------------- *\
-|  void Access(CachedList *clist, FILE *ifp)
+|  char *Access(FILE *ifp, long offset, Index_t bytes)
 |
-|  Make sure clist is in memory.  Make sure the given element is in
+|  Return the list of the given length at offset in the index file,
+|  reading it into the cache if it isn't there.  Make sure it's in
 |  its rightful place in the cache.  If it's already there, just move
 |  it.  Otherwise, insert it into the heap, deleting the oldest
 |  element if the cache is already full.
 \* ----------------------------------------------------------------- */
-void Access(CachedList *clist, FILE *ifp)
+char *Access(FILE *ifp, long offset, Index_t bytes)
 {
-    if (clist->list == NULL) {
-        if (fseek(ifp, clist->offset, SEEK_SET) != 0)
+    CachedList *clist, **link;
+    int h = (int)(offset % CACHESIZE);
+
+    for (clist = cachehash[h]; clist; clist = clist->next)
+        if ((clist->offset == offset) && (clist->fp == ifp))
+            break;
+
+    if (clist == NULL) {
+        if (fseek(ifp, offset, SEEK_SET) != 0)
             pdie("Error reading", bixfile);
 
-        clist->list = (char *)safemalloc(clist->bytes,
+        clist = (CachedList *)safemalloc(sizeof(CachedList),
+            "Can't allocate index list.", "");
+        clist->list = (char *)safemalloc(bytes,
             "Can't allocate index list.", "");
-        safefread((void *)clist->list, sizeof(char), clist->bytes, ifp);
+        safefread((void *)clist->list, sizeof(char), bytes, ifp);
+        clist->fp = ifp;
+        clist->offset = offset;
+        clist->bytes = bytes;
 
         if (cachenum == CACHESIZE) {        /* if cache is full... */
+            link = cachehash + cache[0].clist->offset % CACHESIZE;
+            while (*link != cache[0].clist)
+                link = &(*link)->next;
+            *link = cache[0].clist->next;
             free(cache[0].clist->list);     /* delete oldest element */
-            cache[0].clist->list = NULL;
+            free(cache[0].clist);
 
             cache[0] = cache[CACHESIZE - 1];
             cache[CACHESIZE - 1].clist = NULL;
@@ -1098,6 +1301,8 @@ void Access(CachedList *clist, FILE *ifp)
             HeapBubble(0);
         }
 
+        clist->next = cachehash[h];
+        cachehash[h] = clist;
         cache[cachenum].stamp = curstamp++;
         cache[cachenum].clist = clist;
         clist->rank = cachenum++;
@@ -1107,30 +1312,96 @@ void Access(CachedList *clist, FILE *ifp)
     }
 
     CheckStamp();
+    return clist->list;
 }
 
 /* ========================== INDEX TABLES ========================= */
 
-typedef struct {
-    Word theword;
-    CachedList refs;
-} Index, *IndexPtr;
+typedef struct {            /* A block of a table's dictionary */
+    uint32 word;                        /* where its first word is */
+    long list;                          /* where that word's list is */
+                                        /* in the index file */
+} WordBlock;
 
 typedef struct {
     Word thefield;
     Index_t numwords;
-    IndexPtr words;
+    Index_t blocksize, numblocks;       /* see StartWords() in bibindex */
+    int codec;                          /* how its lists are written */
+    WordBlock *blocks;
+    unsigned char *dict, *dictend;      /* the front-coded words */
+    unsigned char *buf;                 /* holding them, unless they're */
+                                        /* in the map */
+    long offset;                        /* where the table is in the */
+                                        /* file, or -1 once it's read */
+    long words;                         /* where its words are */
+    long length;                        /* its length in bytes */
 } IndexTable;
 
-Index_s numfields;
-IndexTable *fieldtable;
+typedef struct {            /* A word of a table; see NextWord() */
+    IndexTable *table;
+    Index_t i;                          /* its number in the table */
+    unsigned char *p;                   /* where the next word is */
+    Word word;
+    Index_t length, bytes;              /* its references, the bytes */
+    long offset;                        /* they take, and where they are */
+} WordCursor;
+
+typedef struct {            /* One segment of the index; see bibindex */
+    char filename[FILENAME_MAX + 16];
+    FILE *fp;
+    int version;                        /* file format version */
+    Index_t numfields;
+    IndexTable *fieldtable;
+    long abbrevs;                       /* where the abbreviations are */
+    int firstfield, lastfield;          /* indices into fieldtable */
+    int swap, aligned;                  /* its byte order and layout */
+    char *map;                          /* the file, if it's mapped */
+    long mapsize;
+} Segment;
+
+Segment *segments;
+int numsegments;
+
+#define MAXOPENBIBS 32              /* most collection files kept open */
+
+typedef struct {            /* One file of a collection; see bibindex */
+    char *name;
+    Index_t first;                      /* number of its first entry */
+    FILE *fp;                           /* or NULL if it isn't open */
+} BibMember;
+
+BibMember *members;                 /* NULL unless it's a collection */
+int nummembers;
+
+#define FRAME_WIN   32768       /* deflate window; see bibindex */
+#define FRAME_START 0x100       /* FramePoint.bits: a gzip member starts */
+
+typedef struct {            /* An access point into a gzip'ed bib file */
+    Off_t out;                          /* uncompressed offset */
+    Off_t in;                           /* compressed offset */
+    Index_s bits;                       /* unused bits before in, or */
+                                        /* FRAME_START */
+    long window;                        /* where its window is in the */
+                                        /* index file, or -1 */
+} FramePoint;
+
+FramePoint *frames;                 /* NULL unless the bib is gzip'ed */
+Index_t numframes;
+Off_t framelength;                  /* uncompressed length of the bib */
+FILE *framefp;                      /* the index file, for the windows */
 
 Index_t numabbrevs;
 Word *abbrevs;
 Index_t *abbrevlocs;
+Index_t *expnumbers;                /* words in each abbrev's expansion */
+Word **expansions;                  /* and the words themselves */
+Index_t *macrofirst;                /* see MatchMacros() */
 
 Index_t numoffsets;
 Off_t *offsets;
+int offsetsmapped;                  /* offsets points into a map */
+int usemaps = 1;                    /* unless BIBLOOKNOMAP is set */
 
 /* ----------------------------------------------------------------- *\
 |  void ReadWord(FILE *ifp, Word word)
@@ -1139,9 +1410,8 @@ Off_t *offsets;
 \* ----------------------------------------------------------------- */
 void ReadWord(FILE *ifp, Word word)
 {
-    unsigned char length;
+    Index_t length = ReadCount(ifp, sizeof(unsigned char));
 
-    safefread((void *)&length, sizeof(unsigned char), 1, ifp);
     if (length > MAXWORD)
         die("Index file is corrupt", "(word too long).");
 
@@ -1153,105 +1423,692 @@ void ReadWord(FILE *ifp, Word word)
 #endif /* DEBUG */
 }
 
+/* ----------------------------------------------------------------- *\
+|  void NewTable(IndexTable *table, uint32 *size)
+|  void PoolWord(IndexTable *table, Index_t i, const char *word,
+|                size_t length, Index_t refs, Index_t bytes, long list,
+|                uint32 *used, uint32 *size)
+|  void EndTable(IndexTable *table, uint32 used)
+|
+|  Make room for a table's numwords words, in an index from before
+|  version 9, which has no dictionary, add the ith word, of the given
+|  length, with its refs references in bytes bytes at list in the
+|  file, and finish the table.  The words go in a dictionary of the
+|  table's own, in blocks of one word, since their lists aren't one
+|  after another in the file.
+\* ----------------------------------------------------------------- */
+void NewTable(IndexTable *table, uint32 *size)
+{
+    table->codec = CODEC_VARINT;
+    table->blocksize = 1;
+    table->numblocks = table->numwords;
+    table->blocks = (WordBlock *)safemalloc(table->numblocks *
+        sizeof(WordBlock), "Can't create index table for", table->thefield);
+
+    *size = table->numwords * 16 + 3 * 5 + sizeof(Word);
+    table->buf = (unsigned char *)safemalloc(*size,
+        "Can't create index table for", table->thefield);
+}
+
+static size_t PutCount(unsigned char *p, Index_t n)
+{
+    unsigned char *p0 = p;
+
+    while (n >= (Index_t)CHAR_HIGHBIT) {
+        *p++ = (unsigned char)(n | CHAR_HIGHBIT);
+        n >>= (CHAR_BIT - 1);
+    }
+    *p++ = (unsigned char)n;
+    return p - p0;
+}
+
+void PoolWord(IndexTable *table, Index_t i, const char *word,
+    size_t length, Index_t refs, Index_t bytes, long list,
+    uint32 *used, uint32 *size)
+{
+    unsigned char *p;
+
+    if (*used + length + 3 * 5 > *size) {
+        *size *= 2;
+        table->buf = (unsigned char *)realloc(table->buf, *size);
+        if (table->buf == NULL)
+            die("Can't create index table for", table->thefield);
+    }
+    table->blocks[i].word = *used;
+    table->blocks[i].list = list;
+    p = table->buf + *used;
+    p += PutCount(p, (Index_t)length);
+    memcpy(p, word, length);
+    p += length;
+    p += PutCount(p, refs);
+    p += PutCount(p, bytes);
+    *used = p - table->buf;
+}
+
+void EndTable(IndexTable *table, uint32 used)
+{
+    table->dict = table->buf;
+    table->dictend = table->buf + used;
+    table->offset = -1;
+}
+
 /* ----------------------------------------------------------------- *\
 |  void GetOneTable(FILE *ifp, IndexTable *table)
 |
-|  Get one index table from the file
+|  Get one index table from the file, as it comes, in an index
+|  without a table directory (before version 7).
 \* ----------------------------------------------------------------- */
 void GetOneTable(FILE *ifp, IndexTable *table)
 {
-    Index_t i;
+    Index_t i, refs, bytes;
+    uint32 used, size;
+    Word word;
+    long list;
 
-    safefread((void *)&table->numwords, sizeof(Index_t), 1, ifp);
-    ConvertToHostOrder(1, sizeof(Index_t), &table->numwords);
-    table->words = (IndexPtr)safemalloc(table->numwords * sizeof(Index),
-        "Can't create index table for", table->thefield);
+    table->numwords = ReadCount(ifp, sizeof(Index_t));
+    NewTable(table, &size);
+    used = 0;
 
     for (i = 0; i < table->numwords; i++) {
-        ReadWord(ifp, table->words[i].theword);
-        InitCachedList(&(table->words[i].refs), ifp);
+        ReadWord(ifp, word);
+        refs = ReadCount(ifp, sizeof(Index_s));
+        bytes = ReadCount(ifp, sizeof(Index_s));
+        list = ftell(ifp);
+        if (fseek(ifp, (long)bytes, SEEK_CUR) != 0)
+            pdie("Error reading", bixfile);
+        PoolWord(table, i, word, strlen(word), refs, bytes, list,
+            &used, &size);
     }
+    EndTable(table, used);
 }
 
-FILE *bixfp;
+/* ----------------------------------------------------------------- *\
+|  Index_t TakeCount(unsigned char **p, unsigned char *end)
+|
+|  ReadCount() for a table in memory, ending at end.
+\* ----------------------------------------------------------------- */
+Index_t TakeCount(unsigned char **p, unsigned char *end)
+{
+    Index_t n = 0;
+    int ch, shift = 0;
+
+    do {
+        if ((*p >= end) || (shift > 28))
+            die("Index file is corrupt", "(bad count).");
+        ch = *(*p)++;
+        n |= (Index_t)(ch & ~CHAR_HIGHBIT) << shift;
+        shift += CHAR_BIT - 1;
+    } while (ch & CHAR_HIGHBIT);
+    return n;
+}
 
 /* ----------------------------------------------------------------- *\
-|  void GetTables(VOID)
+|  void UseSegment(Segment *seg)
 |
-|  Get the tables from the index file.
+|  Have the routines above read numbers the way the segment's file
+|  has them.
 \* ----------------------------------------------------------------- */
-void GetTables(VOID)
+void UseSegment(Segment *seg)
 {
-    int version, i;
-    Index_t k;
+    fileversion = seg->version;
+    fileswap = seg->swap;
+    filealigned = seg->aligned;
+}
 
-    if (fscanf(bixfp, "bibindex %d %*[^\n]%*c", &version) < 1)
-        die(bixfile, "is not a bibindex file!");
-    if (version < FILE_VERSION)
-        die(bixfile, "is the wrong version.\n\tPlease rerun bibindex.");
-    if (version > FILE_VERSION)
-        die(bixfile, "is the wrong version.\n\tPlease recompile biblook.");
+/* ----------------------------------------------------------------- *\
+|  void *MapFixed(Segment *seg, size_t s, Index_t n)
+|
+|  Skip an array of n numbers of size s in a mapped segment, and
+|  return where it is in the map, so that it needn't be copied.
+|  Returns NULL unless the segment is mapped and native, with the
+|  numbers the way the host has them, so the array has to be read.
+\* ----------------------------------------------------------------- */
+void *MapFixed(Segment *seg, size_t s, Index_t n)
+{
+    long pos;
+
+    if (!seg->map || !seg->aligned || seg->swap)
+        return NULL;
+    pos = ftell(seg->fp);
+    pos += (long)((s - pos % s) % s);
+    if ((pos < 0) || ((double)n * s > (double)(seg->mapsize - pos)))
+        die("Index file is corrupt", "(array too long).");
+    if (fseek(seg->fp, pos + (long)(n * s), SEEK_SET) != 0)
+        pdie("Error reading", seg->filename);
+    return (void *)(seg->map + pos);
+}
 
-    InitCache();
+/* ----------------------------------------------------------------- *\
+|  void LoadTable(Segment *seg, IndexTable *table)
+|
+|  Get a table that the segment's directory points to, unless that's
+|  been done already.  Only the block index and the dictionary are
+|  read, or found in the map; the reference lists are left for
+|  AddRefs() to find.  Tables from before version 9 are read whole,
+|  and given a dictionary (see NewTable()).
+\* ----------------------------------------------------------------- */
+void LoadTable(Segment *seg, IndexTable *table)
+{
+    unsigned char *buf, *p, *end, *word;
+    Index_t i, b, length, refs, bytes;
+    uint32 used, size;
+    long start, n, list;
 
-    safefread((void *)&numoffsets, sizeof(Index_t), 1, bixfp);
-    ConvertToHostOrder(1, sizeof(Index_t), &numoffsets);
-    offsets = (Off_t *)safemalloc(numoffsets * sizeof(Off_t),
-        "Can't create offset table", "");
+    if (table->offset < 0)
+        return;
+
+    start = (seg->version >= 9) ? table->words : table->offset;
+    n = table->offset + table->length - start;
+    if (seg->map) {
+        if (table->offset + table->length > seg->mapsize)
+            die("Index file is corrupt", "(bad table directory).");
+        buf = (unsigned char *)seg->map + start;
+    } else {
+        buf = (unsigned char *)safemalloc(n + 1,
+            "Can't create index table for", table->thefield);
+        if (fseek(seg->fp, start, SEEK_SET) != 0)
+            pdie("Error reading", seg->filename);
+        safefread((void *)buf, sizeof(char), n, seg->fp);
+    }
+    p = buf;
+    end = buf + n;
+
+    if (seg->version >= 9) {
+        table->blocksize = TakeCount(&p, end);
+        if (!table->blocksize)
+            die("Index file is corrupt", "(bad block size).");
+        table->codec = (seg->version >= 10) ?
+            (int)TakeCount(&p, end) : CODEC_VARINT;
+        if (table->codec > CODEC_STREAM)
+            die("Index file is corrupt", "(unknown codec).");
+        table->numblocks = table->numwords ?
+            (table->numwords - 1) / table->blocksize + 1 : 0;
+        table->blocks = (WordBlock *)safemalloc(table->numblocks *
+            sizeof(WordBlock), "Can't create index table for",
+            table->thefield);
+        used = 0;
+        list = table->offset;
+        for (b = 0; b < table->numblocks; b++) {
+            used += TakeCount(&p, end);
+            list += TakeCount(&p, end);
+            table->blocks[b].word = used;
+            table->blocks[b].list = list;
+        }
+        table->dict = p;
+        table->dictend = end;
+        if (table->numblocks &&
+                (table->blocks[b - 1].word >= (uint32)(end - p)))
+            die("Index file is corrupt", "(bad block index).");
+        table->buf = seg->map ? NULL : buf;
+        table->offset = -1;
+        return;
+    }
+
+    if (TakeCount(&p, end) != table->numwords)
+        die("Index file is corrupt", "(bad table directory).");
+    NewTable(table, &size);
+    used = 0;
+
+    for (i = 0; i < table->numwords; i++) {
+        length = TakeCount(&p, end);
+        if ((length > MAXWORD) || (length > (Index_t)(end - p)))
+            die("Index file is corrupt", "(word too long).");
+        word = p;
+        p += length;
+        refs = TakeCount(&p, end);
+        bytes = TakeCount(&p, end);
+        if (bytes > (Index_t)(end - p))
+            die("Index file is corrupt", "(list too long).");
+        PoolWord(table, i, (char *)word, length, refs, bytes,
+            start + (long)(p - buf), &used, &size);
+        p += bytes;
+    }
+
+    if (!seg->map)
+        free(buf);
+    EndTable(table, used);
+}
+
+/* ----------------------------------------------------------------- *\
+|  int NextWord(WordCursor *cur)
+|  int SeekBlock(WordCursor *cur, IndexTable *table, Index_t b)
+|
+|  Move on to the next word of the table, or to the first word of
+|  block b of the given table, decoding it from the dictionary.
+|  Return 0 if there's no such word.
+\* ----------------------------------------------------------------- */
+int NextWord(WordCursor *cur)
+{
+    IndexTable *table = cur->table;
+    unsigned char *p = cur->p, *end = table->dictend;
+    Index_t shared, length;
+
+    if (++cur->i >= table->numwords) {
+        cur->i = table->numwords;
+        return 0;
+    }
+    if (cur->i % table->blocksize == 0) {
+        shared = 0;
+        cur->offset = table->blocks[cur->i / table->blocksize].list;
+    } else {
+        shared = TakeCount(&p, end);
+        cur->offset += cur->bytes;
+    }
+    length = TakeCount(&p, end);
+    if ((shared > (Index_t)strlen(cur->word)) ||
+            (length > MAXWORD - shared) || (length > (Index_t)(end - p)))
+        die("Index file is corrupt", "(word too long).");
+    memcpy(cur->word + shared, p, length);
+    cur->word[shared + length] = 0;
+    p += length;
+
+    cur->length = TakeCount(&p, end);
+    cur->bytes = TakeCount(&p, end);
+    cur->p = p;
+    return 1;
+}
+
+int SeekBlock(WordCursor *cur, IndexTable *table, Index_t b)
+{
+    cur->table = table;
+    if (b >= table->numblocks) {
+        cur->i = table->numwords;
+        return 0;
+    }
+    cur->i = b * table->blocksize - 1;
+    cur->p = table->dict + table->blocks[b].word;
+    cur->bytes = 0;
+    return NextWord(cur);
+}
+
+/* ----------------------------------------------------------------- *\
+|  Index_t SegmentStart(Segment *seg)
+|
+|  Return the number of the first entry of a delta segment, which is
+|  in the segment information at the end of the file, found through
+|  the offset in its last four (version 4) or eight bytes.
+\* ----------------------------------------------------------------- */
+Index_t SegmentStart(Segment *seg)
+{
+    Word tag;
+    Off_t where;
+    int32 narrow;
+    Index_t first;
+
+    if (seg->version < 5) {
+        if ((fseek(seg->fp, -(long)sizeof(int32), SEEK_END) != 0) ||
+                (fread((void *)&narrow, sizeof(int32), 1, seg->fp) != 1))
+            return INDEX_NAN;
+        ConvertToHostOrder(1, sizeof(int32), &narrow);
+        where = narrow;
+    } else {
+        if ((fseek(seg->fp, -(long)sizeof(Off_t), SEEK_END) != 0) ||
+                (fread((void *)&where, sizeof(Off_t), 1, seg->fp) != 1))
+            return INDEX_NAN;
+        ConvertToHostOrder(1, sizeof(Off_t), &where);
+    }
+    if (fseek(seg->fp, (long)where, SEEK_SET) != 0)
+        return INDEX_NAN;
+
+    ReadWord(seg->fp, tag);
+    if (strcmp(tag, "@segment"))
+        return INDEX_NAN;
+    ReadFixed(seg->fp, (void *)&first, sizeof(Index_t), 1);
+    return first;
+}
+
+/* ----------------------------------------------------------------- *\
+|  int GetSegment(Segment *seg, int k)
+|
+|  Get the tables from segment k of the index, adding its entries to
+|  the offset table.  Returns 0 if there is no such segment, or if it
+|  doesn't follow on from the segments before it, as happens while
+|  bibindex is removing old segments.
+\* ----------------------------------------------------------------- */
+int GetSegment(Segment *seg, int k)
+{
+    int i;
+    Index_t count;
+    IndexTable *table = NULL;
+    Off_t *more, where, length, words;
+    long start, dirend;
+    uint32 mark, swapped;
+#if HAVE_MMAP
+    struct stat st;
+    void *map;
+#endif
+
+    if (k)
+        (void)sprintf(seg->filename, "%s.%d", bixfile, k);
+    else
+        strcpy(seg->filename, bixfile);
+
+#if MSDOS
+    seg->fp = fopen(seg->filename, "rb");
+#else
+    seg->fp = fopen(seg->filename, "r");
+#endif
+    if (!seg->fp) {
+        if (k)
+            return 0;
+        pdie("Can't read", seg->filename);
+    }
+
+    if (fscanf(seg->fp, "bibindex %d %*[^\n]%*c", &seg->version) < 1)
+        die(seg->filename, "is not a bibindex file!");
+    if (seg->version < OLD_VERSION)
+        die(seg->filename, "is the wrong version.\n\tPlease rerun bibindex.");
+    if (seg->version > FILE_VERSION)
+        die(seg->filename, "is the wrong version.\n\tPlease recompile biblook.");
+    seg->swap = (htonl(1) != 1);
+    seg->aligned = 0;
+    if (seg->version >= 8) {            /* see ORDER_MARK */
+        safefread((void *)&mark, sizeof(uint32), 1, seg->fp);
+        swapped = mark;
+        SwapBytes(1, sizeof(uint32), &swapped);
+        seg->swap = (swapped == NATIVE_MARK) || (swapped == ORDER_MARK);
+        seg->aligned = (mark == NATIVE_MARK) || (swapped == NATIVE_MARK);
+        if (!seg->swap && (mark != ORDER_MARK) && !seg->aligned)
+            die(seg->filename, "is not a bibindex file!");
+    }
+    UseSegment(seg);
+    start = ftell(seg->fp);
+
+    if (k && ((SegmentStart(seg) != numoffsets) ||
+            (fseek(seg->fp, start, SEEK_SET) != 0))) {
+        fclose(seg->fp);
+        return 0;
+    }
+
+    seg->map = NULL;
+    seg->mapsize = 0;
+#if HAVE_MMAP
+    if (usemaps && (fstat(fileno(seg->fp), &st) == 0) &&
+            (st.st_size > 0) && (st.st_size <= LONG_MAX)) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+            fileno(seg->fp), 0);
+        if (map != MAP_FAILED) {
+            seg->map = (char *)map;
+            seg->mapsize = (long)st.st_size;
+        }
+    }
+#endif /* HAVE_MMAP */
+
+    ReadFixed(seg->fp, (void *)&count, sizeof(Index_t), 1);
+    if (!numoffsets &&
+            (more = (Off_t *)MapFixed(seg, sizeof(Off_t), count))) {
+        offsets = more;                 /* used where it is */
+        offsetsmapped = 1;
+    } else {
+        more = (Off_t *)malloc((numoffsets + count) * sizeof(Off_t));
+        if (!more && (numoffsets + count))
+            die("Can't create offset table", "");
+        if (numoffsets)
+            memcpy(more, offsets, numoffsets * sizeof(Off_t));
+        if (!offsetsmapped)
+            free(offsets);
+        offsets = more;
+        offsetsmapped = 0;
+        ReadOffsets(seg->fp, offsets + numoffsets, count);
+    }
+    numoffsets += count;
+
+    seg->numfields = ReadCount(seg->fp, sizeof(Index_s));
+    seg->fieldtable = (IndexTable *)safemalloc(seg->numfields *
+        sizeof(IndexTable), "Can't create field table", "");
+
+    for (i = 0; i < (int)seg->numfields; i++)
+        ReadWord(seg->fp, seg->fieldtable[i].thefield);
+
+    if (seg->version < 7) {
+        for (i = 0; i < (int)seg->numfields; i++)
+            GetOneTable(seg->fp, seg->fieldtable + i);
+        seg->abbrevs = ftell(seg->fp);
+    } else {                            /* the directory; see LoadTable() */
+        for (i = 0; i < (int)seg->numfields; i++) {
+            table = seg->fieldtable + i;
+            ReadOffsets(seg->fp, &where, 1);
+            ReadOffsets(seg->fp, &length, 1);
+            words = where;
+            if (seg->version >= 9)
+                ReadOffsets(seg->fp, &words, 1);
+            ReadFixed(seg->fp, (void *)&table->numwords, sizeof(Index_t), 1);
+            table->offset = (long)where;
+            table->length = (long)length;
+            table->words = (long)words;
+            table->blocks = NULL;
+            table->buf = NULL;
+        }
+        dirend = ftell(seg->fp);
+        for (i = 0; i < (int)seg->numfields; i++) {
+            table = seg->fieldtable + i;
+            if ((table->offset < dirend) || (table->length < 1) ||
+                    (table->words < table->offset) ||
+                    (table->words >= table->offset + table->length))
+                die("Index file is corrupt", "(bad table directory).");
+        }
+        seg->abbrevs = seg->numfields ? table->offset + table->length :
+            dirend;
+    }
+    seg->firstfield = seg->lastfield = -1;
+    return 1;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void GetFileTable(FILE *ifp)
+|
+|  Get the file table of a collection.  Relative names are relative
+|  to the directory of the index file.
+\* ----------------------------------------------------------------- */
+void GetFileTable(FILE *ifp)
+{
+    Index_t n, k, len;
+    const char *slash = strrchr(bixfile, '/');
+    int dirlen = slash ? (int)(slash - bixfile) + 1 : 0;
+
+    n = ReadCount(ifp, sizeof(Index_t));
+    if (n > (Index_t)INT_MAX / sizeof(BibMember))
+        die("Index file is corrupt", "(too many files).");
+    members = (BibMember *)safemalloc(n * sizeof(BibMember),
+        "Can't create file table", "");
+
+    for (k = 0; k < n; k++) {
+        len = ReadCount(ifp, sizeof(Index_s));
+        if (len > (Index_t)(FILENAME_MAX - dirlen))
+            die("Index file is corrupt", "(file name too long).");
+        members[k].name = (char *)safemalloc(dirlen + len + 1,
+            "Can't create file table", "");
+        safefread((void *)(members[k].name + dirlen), sizeof(char), len, ifp);
+        members[k].name[dirlen + len] = 0;
+        if (members[k].name[dirlen] == '/')
+            memmove(members[k].name, members[k].name + dirlen, len + 1);
+        else
+            memcpy(members[k].name, bixfile, dirlen);
+        members[k].fp = NULL;
+    }
+    for (k = 0; k < n; k++) {
+        ReadFixed(ifp, (void *)&members[k].first, sizeof(Index_t), 1);
+    }
+    nummembers = (int)n;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void GetFrameTable(FILE *ifp)
+|
+|  Get the access points of a gzip'ed bib file.  The windows that
+|  follow them stay in the index file until they're needed.
+\* ----------------------------------------------------------------- */
+void GetFrameTable(FILE *ifp)
+{
+    Index_t k;
+    long pos;
+
+    ReadOffsets(ifp, &framelength, 1);
+    numframes = ReadCount(ifp, sizeof(Index_t));
+    if ((numframes == 0) ||
+            (numframes > (Index_t)INT_MAX / sizeof(FramePoint)))
+        die("Index file is corrupt", "(bad frame table).");
+    frames = (FramePoint *)safemalloc(numframes * sizeof(FramePoint),
+        "Can't create frame table", "");
+
+    for (k = 0; k < numframes; k++) {
+        ReadOffsets(ifp, &frames[k].out, 1);
+        ReadOffsets(ifp, &frames[k].in, 1);
+        ReadFixed(ifp, (void *)&frames[k].bits, sizeof(Index_s), 1);
+    }
+
+    pos = ftell(ifp);
+    for (k = 0; k < numframes; k++) {
+        if (frames[k].bits & FRAME_START) {
+            frames[k].window = -1;
+        } else {
+            frames[k].window = pos;
+            pos += FRAME_WIN;
+        }
+    }
+    framefp = ifp;
+}
 
-    safefread((void *)offsets, sizeof(Off_t), numoffsets, bixfp);
-    ConvertToHostOrder(numoffsets, sizeof(Off_t), offsets);
+/* ----------------------------------------------------------------- *\
+|  void GetTables(VOID)
+|
+|  Get the tables from the index file, and from its delta segments,
+|  bixfile.1, bixfile.2, and so on.  The segments number their
+|  entries on from each other, so the offset tables are simply put
+|  together.  Each segment has all the abbreviations so far, so they
+|  come from the newest one, and so do their expansions (see
+|  FindMacros()).  The index of a collection has a file table after
+|  its abbreviations, and that of a gzip'ed bib file a frame table.
+\* ----------------------------------------------------------------- */
+void GetTables(VOID)
+{
+    Segment *seg;
+    Word tag;
+    Index_t j, k;
+    int ch;
+
+    InitCache();
 
-    safefread((void *)&numfields, sizeof numfields, 1, bixfp);
-    ConvertToHostOrder(1, sizeof numfields, &numfields);
-    fieldtable = (IndexTable *)safemalloc(numfields * sizeof(IndexTable),
-        "Can't create field table", "");
+    numoffsets = 0;
+    offsets = NULL;
+    offsetsmapped = 0;
+    segments = NULL;
+    for (numsegments = 0;; numsegments++) {
+        segments = (Segment *)realloc(segments,
+            (numsegments + 1) * sizeof(Segment));
+        if (!segments)
+            die("Can't create segment table", "");
+        if (!GetSegment(segments + numsegments, numsegments))
+            break;
+    }
 
-    for (i = 0; i < (int)numfields; i++)
-        ReadWord(bixfp, fieldtable[i].thefield);
-    for (i = 0; i < (int)numfields; i++)
-        GetOneTable(bixfp, fieldtable + i);
+    seg = segments + numsegments - 1;
+    if (fseek(seg->fp, seg->abbrevs, SEEK_SET) != 0)
+        pdie("Error reading", seg->filename);
+    UseSegment(seg);
 
-    safefread((void *)&numabbrevs, sizeof(Index_t), 1, bixfp);
-    ConvertToHostOrder(1, sizeof(Index_t), &numabbrevs);
+    numabbrevs = ReadCount(seg->fp, sizeof(Index_t));
 
     abbrevs = (Word *)safemalloc(numabbrevs * sizeof(Word),
         "Can't create abbreviation table", "");
 
     for (k = 0; k < numabbrevs; k++)
-        ReadWord(bixfp, abbrevs[k]);
+        ReadWord(seg->fp, abbrevs[k]);
+
+    abbrevlocs = (Index_t *)MapFixed(seg, sizeof(Index_t), numabbrevs);
+    if (!abbrevlocs) {
+        abbrevlocs = (Index_t *)safemalloc(numabbrevs * sizeof(Index_t),
+            "Can't create abbrev offset table", "");
+        ReadFixed(seg->fp, (void *)abbrevlocs, sizeof(Index_t), numabbrevs);
+    }
 
-    abbrevlocs = (Index_t *)safemalloc(numabbrevs * sizeof(Index_t),
-        "Can't create abbrev offset table", "");
+    expnumbers = (Index_t *)safemalloc(numabbrevs * sizeof(Index_t),
+        "Can't create expansion table", "");
+    expansions = (Word **)safemalloc(numabbrevs * sizeof(Word *),
+        "Can't create expansion table", "");
+    macrofirst = (Index_t *)safemalloc(numabbrevs * sizeof(Index_t),
+        "Can't create expansion table", "");
+
+    for (k = 0; k < numabbrevs; k++) {  /* version 6 and later */
+        expnumbers[k] = (fileversion < 6) ? 0 :
+            ReadCount(seg->fp, sizeof(Index_t));
+        if (expnumbers[k] > (Index_t)INT_MAX / sizeof(Word))
+            die("Index file is corrupt", "(expansion too long).");
+        expansions[k] = (Word *)safemalloc(expnumbers[k] * sizeof(Word),
+            "Can't create expansion table", "");
+        for (j = 0; j < expnumbers[k]; j++)
+            ReadWord(seg->fp, expansions[k][j]);
+    }
 
-    safefread((void *)abbrevlocs, sizeof(Index_t), numabbrevs, bixfp);
-    ConvertToHostOrder(numabbrevs, sizeof(Index_t), abbrevlocs);
+    members = NULL;
+    nummembers = 0;
+    frames = NULL;
+    numframes = 0;
+    if ((ch = getc(seg->fp)) != EOF) {
+        (void)ungetc(ch, seg->fp);
+        ReadWord(seg->fp, tag);
+        if (!strcmp(tag, "@files"))
+            GetFileTable(seg->fp);
+        else if (!strcmp(tag, "@frames"))
+            GetFrameTable(seg->fp);
+    }
 }
 
 /* ----------------------------------------------------------------- *\
 |  void FreeTables(void)
 |
-|  Free the index tables.
+|  Free the index tables, and close the segments and the files of a
+|  collection.
 \* ----------------------------------------------------------------- */
 void FreeTables(VOID)
 {
-    register int i;
+    register int i, k;
 
     FreeCache();                        /* free all index lists in memory */
 
-    for (i = 0; i < (int)numfields; i++)
-        free(fieldtable[i].words);
+    for (k = 0; k < numsegments; k++) {
+        for (i = 0; i < (int)segments[k].numfields; i++) {
+            free(segments[k].fieldtable[i].blocks);
+            free(segments[k].fieldtable[i].buf);
+        }
+        free(segments[k].fieldtable);
+#if HAVE_MMAP
+        if (segments[k].map)
+            (void)munmap(segments[k].map, (size_t)segments[k].mapsize);
+#endif /* HAVE_MMAP */
+        fclose(segments[k].fp);
+    }
 
-    free(fieldtable);
-    free(offsets);
+    for (k = 0; k < nummembers; k++) {
+        if (members[k].fp)
+            fclose(members[k].fp);
+        free(members[k].name);
+    }
+
+    for (k = 0; k < (int)numabbrevs; k++)
+        free(expansions[k]);
+    free(expansions);
+    free(expnumbers);
+    free(macrofirst);
+
+    free(members);
+    free(frames);
+    free(segments);
+    if (!offsetsmapped)
+        free(offsets);
 }
 
 /* ----------------------------------------------------------------- *\
-|  Index_t FindIndex(IndexTable table, char *word, char prefix)
+|  int FindIndex(WordCursor *cur, IndexTable *table, char *prefix,
+|                char *suffix, char *word)
+|  int FindNextIndex(WordCursor *cur, char *prefix, char *suffix,
+|                    char *word)
 |
-|  Find the index of a word in a table.  Return INDEX_NAN if the word
-|  isn't there.  If prefix is true, return the index of the first
-|  matching word.
+|  Find the first word in a table that matches the word, which may
+|  be a pattern, with the given prefix before its first wildcard, or
+|  the next one after cur.  Return 0 if there isn't one.  The blocks
+|  of the dictionary are binary-searched on their first words, and
+|  then the words of one block scanned.
 \* ----------------------------------------------------------------- */
 
 static void breakWord(char *word, char *prefix, char *suffix)
@@ -1269,64 +2126,64 @@ static void breakWord(char *word, char *prefix, char *suffix)
     strcpy(suffix, pos);
 }
 
-static Index_t linear_scan(IndexTable table, char *prefix, char *suffix,
-                           char *word, int lo)
+static int linear_scan(WordCursor *cur, char *prefix, char *suffix,
+                       char *word)
 {
-    register IndexPtr words = table.words;
     register int times, len;            /* must be signed */
 
     (void)suffix;
 
-    /* we perform a linear scan from lo. We need to scan at least 2 places */
+    /* we perform a linear scan from cur. We need to scan at least 2 places */
     times = 0;
     len = strlen(prefix);
-    while (lo < (int)table.numwords) {
-        if (strncmp(prefix, words[lo].theword, len) && times > 3)
+    do {
+        if (strncmp(prefix, cur->word, len) && times > 3)
             break;
-        if (!strptrcmp(words[lo].theword, word))
-            return lo;
+        if ((cur->word[0] != MACRO_MARK) && !strptrcmp(cur->word, word))
+            return 1;
 
         times++;
-        lo++;
-    }
+    } while (NextWord(cur));
 
-    return (Index_t)INDEX_NAN;
+    return 0;
 }
 
-Index_t FindIndex(IndexTable table, char *prefix, char *suffix,
-                  char *word, char _prefix)
+int FindIndex(WordCursor *cur, IndexTable *table, char *prefix,
+              char *suffix, char *word)
 {
-    register IndexPtr words = table.words;
     register int hi, lo, mid;           /* must be signed */
-    register int cmp;
-
-    (void)_prefix;                      /* kill warnning */
+    Index_t block = 0;
 
-    hi = table.numwords - 1;
+    hi = table->numblocks - 1;
     lo = 0;
 
-    /* binary search for the place that matches the prefix */
+    /* binary search for the last block starting before the prefix */
     while (hi >= lo) {
         mid = (hi + lo) / 2;
-        cmp = strcmp(prefix, words[mid].theword);
+        (void)SeekBlock(cur, table, (Index_t)mid);
 
-        if (cmp <= 0)
+        if (strcmp(prefix, cur->word) <= 0) {
             hi = mid - 1;
-        else if (cmp > 0)
+        } else {
+            block = mid;
             lo = mid + 1;
+        }
     }
 
-    return linear_scan(table, prefix, suffix, word, lo);
+    /* and for the place in it that matches the prefix */
+    if (!SeekBlock(cur, table, block))
+        return 0;
+    while (strcmp(prefix, cur->word) > 0)
+        if (!NextWord(cur))
+            return 0;
+
+    return linear_scan(cur, prefix, suffix, word);
 }
 
 /* this was really dumb... */
-Index_t FindNextIndex(IndexTable table, char *prefix, char *suffix,
-    char *word, char _prefix, int lo)
+int FindNextIndex(WordCursor *cur, char *prefix, char *suffix, char *word)
 {
-    (void)_prefix;
-
-    lo++;
-    return linear_scan(table, prefix, suffix, word, lo);
+    return NextWord(cur) && linear_scan(cur, prefix, suffix, word);
 }
 
 /* ----------------------------------------------------------------- *\
@@ -1466,19 +2323,43 @@ int CountSet(Set theset)
 }
 
 /* ----------------------------------------------------------------- *\
-|  void BuildSet(Set theset, Index_t *thelist, Index_t length)
+|  void AddToSet(Set theset, Index_t *thelist, Index_t length)
 |
-|  Build a set out of a list of integers
+|  Add a list of integers to the set
 \* ----------------------------------------------------------------- */
-void BuildSet(Set theset, Index_t *thelist, Index_t length)
+void AddToSet(Set theset, Index_t *thelist, Index_t length)
 {
     register Index_t i;
 
-    EmptySet(theset);
     for (i = 0; i < length; i++)
         theset[thelist[i] / SETSCALE] |= (Set_t)1 << (thelist[i] % SETSCALE);
 }
 
+/* ----------------------------------------------------------------- *\
+|  int SetMeets(Set theset, Index_t from, Index_t to)
+|
+|  Does the set have any of the integers from from to to?
+\* ----------------------------------------------------------------- */
+int SetMeets(Set theset, Index_t from, Index_t to)
+{
+    register Index_t i, last;
+    Set_t bits;
+
+    if ((from > to) || (from >= numoffsets))
+        return 0;
+    if (to >= numoffsets)
+        to = numoffsets - 1;
+    i = from / SETSCALE;
+    last = to / SETSCALE;
+    bits = theset[i] & (~(Set_t)0 << (from % SETSCALE));
+    while (i < last) {
+        if (bits)
+            return 1;
+        bits = theset[++i];
+    }
+    return (bits & (~(Set_t)0 >> (SETSCALE - 1 - to % SETSCALE))) != 0;
+}
+
 /* ----------------------------------------------------------------- *\
 |  void DoForSet(Set theset, void (*action)(int, void *), void *arg)
 |
@@ -1497,8 +2378,7 @@ void DoForSet(Set theset, void (*action)(int, void *), void *arg)
 
 /* ======================== SEARCH ROUTINES ======================== */
 
-Set results, oldresults, oneword, onefield;
-short firstfield, lastfield;            /* indices into fieldtable */
+Set results, oldresults, oneword;
 
 /* ----------------------------------------------------------------- *\
 |  void InitSearch(void)
@@ -1510,8 +2390,6 @@ void InitSearch(VOID)
     results = NewSet();
     oldresults = NewSet();
     oneword = NewSet();
-    onefield = NewSet();
-    firstfield = lastfield = -1;
 }
 
 /* ----------------------------------------------------------------- *\
@@ -1524,7 +2402,6 @@ void FreeSearch(VOID)
     free(results);
     free(oldresults);
     free(oneword);
-    free(onefield);
 }
 
 /* ----------------------------------------------------------------- *\
@@ -1567,31 +2444,227 @@ void CombineResults(char invert, char intersect)
 }
 
 /* ----------------------------------------------------------------- *\
-|  char SetUpField(char *field)
+|  int FieldBound(Segment *seg, char *field, int len, int after)
+|
+|  Binary search of a segment's field names, which bibindex sorts.
+|  Return the first one whose first len characters don't come before
+|  field (or, if after is set, come after it).
+\* ----------------------------------------------------------------- */
+static int FieldBound(Segment *seg, char *field, int len, int after)
+{
+    register int lo, hi, mid, cmp;
+
+    lo = 0;
+    hi = (int)seg->numfields;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        cmp = strncmp(seg->fieldtable[mid].thefield, field, len);
+        if ((cmp > 0) || ((cmp == 0) && !after))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/* ----------------------------------------------------------------- *\
+|  int SetUpField(char *field)
 |
-|  Set up the search fields. Return the number of searchable fields.
+|  Set up the search fields in every segment: the fields whose names
+|  start with field, which are next to each other since the names are
+|  sorted, reading their tables the first time round.  Return the
+|  largest number of searchable fields in any segment.
 \* ----------------------------------------------------------------- */
-char SetUpField(char *field)
+int SetUpField(char *field)
 {
-    int i, len;
+    Segment *seg;
+    int i, k, len, most = 0;
 
-    firstfield = -1;
     len = strlen(field);
 
-    for (i = 0; i < (int)numfields; i++) {
-        if (!strncmp(field, fieldtable[i].thefield, len)) {
-            if (firstfield == -1)
-                firstfield = i;
-            lastfield = i;
-        }
+    for (k = 0; k < numsegments; k++) {
+        seg = segments + k;
+        seg->firstfield = FieldBound(seg, field, len, 0);
+        seg->lastfield = FieldBound(seg, field, len, 1) - 1;
+        if (seg->firstfield > seg->lastfield)
+            seg->firstfield = seg->lastfield = -1;
+        if ((seg->firstfield != -1) &&
+                (seg->lastfield - seg->firstfield + 1 > most))
+            most = seg->lastfield - seg->firstfield + 1;
+        for (i = seg->firstfield; (i != -1) && (i <= seg->lastfield); i++)
+            LoadTable(seg, seg->fieldtable + i);
     }
 
-    if (firstfield == -1) {
+    if (!most) {
         (void)printf(COL_WARN "\tNo searchable fields matching \"%s\"."
             COL_RESET "\n", field);
-        return 0;
+    }
+    return most;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void AddBlocks(char *p, Index_t length, Index_t bytes)
+|
+|  Add the entries of a list written with the stream codec to
+|  `oneword'.  Since FindWord() only keeps the ones that are in
+|  `results' already, a block whose skip (see StreamBlock() in
+|  bibindex) says its entries all fall where `results' has none is
+|  passed over without being decoded.
+\* ----------------------------------------------------------------- */
+void AddBlocks(char *p, Index_t length, Index_t bytes)
+{
+    Index_t list[REFBLOCK];
+    Index_t b, numblocks, last, size, prev = (Index_t)-1;
+    unsigned char *skip, *end;
+    char *block;
+
+    skip = (unsigned char *)p;
+    end = skip + bytes;
+    size = TakeCount(&skip, end);
+    if (size > (Index_t)(end - skip))
+        die("Index file is corrupt", "(list too long).");
+    block = (char *)skip + size;
+
+    numblocks = length / REFBLOCK;
+    for (b = 0; b < numblocks; b++) {
+        last = prev + TakeCount(&skip, (unsigned char *)block);
+        size = TakeCount(&skip, (unsigned char *)block);
+        if (size > (Index_t)((char *)end - block))
+            die("Index file is corrupt", "(list too long).");
+        if (SetMeets(results, prev + 1, last)) {
+            if (!UnstreamBlock(list, prev, block, block + size) ||
+                    (list[REFBLOCK - 1] != last))
+                die("Index file is corrupt", "(bad block).");
+            AddToSet(oneword, list, REFBLOCK);
+        }
+        block += size;
+        prev = last;
+    }
+    (void)UncompressRefs(list, block, length % REFBLOCK, prev);
+    AddToSet(oneword, list, length % REFBLOCK);
+}
+
+/* ----------------------------------------------------------------- *\
+|  void AddRefs(Segment *seg, WordCursor *cur)
+|
+|  Add the entries of one of the segment's words to `oneword'.  In a
+|  mapped segment, the list is uncompressed straight from the map,
+|  and the kernel decides what stays in memory; otherwise it's read
+|  into the cache.
+\* ----------------------------------------------------------------- */
+void AddRefs(Segment *seg, WordCursor *cur)
+{
+    Index_t *p;
+    char *list;
+
+    if (seg->map) {
+        if ((cur->offset < 0) ||
+                ((long)cur->bytes > seg->mapsize - cur->offset))
+            die("Index file is corrupt", "(list too long).");
+        list = seg->map + cur->offset;
     } else {
-        return lastfield - firstfield + 1;
+        list = Access(seg->fp, cur->offset, cur->bytes);
+    }
+    if ((cur->table->codec == CODEC_STREAM) && (cur->length >= REFBLOCK)) {
+        AddBlocks(list, cur->length, cur->bytes);
+        return;
+    }
+    p = (Index_t *)safemalloc(cur->length * sizeof(Index_t),
+        "Can't allocate entry list.", "");
+    (void)UncompressRefs(p, list, cur->length, (Index_t)-1);
+    AddToSet(oneword, p, cur->length);
+    free(p);
+}
+
+/* ----------------------------------------------------------------- *\
+|  int MatchMacros(char *word)
+|
+|  An entry that uses an abbreviation only has the abbreviation's
+|  macro word in the field: MACRO_MARK, the abbreviation, '=', and
+|  the number of words its expansion had then.  Note, for every
+|  abbreviation, how many words of its expansion a use needs to
+|  include one that matches the word, or 0 if none ever will.
+|  Returns 0 if no abbreviation matches at all.
+\* ----------------------------------------------------------------- */
+int MatchMacros(char *word)
+{
+    Index_t j, k;
+    int found = 0;
+
+    for (k = 0; k < numabbrevs; k++) {
+        macrofirst[k] = 0;
+        for (j = 0; j < expnumbers[k]; j++) {
+            if (!strptrcmp(expansions[k][j], word)) {
+                macrofirst[k] = j + 1;
+                found = 1;
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void FindMacros(Segment *seg, IndexTable *table)
+|
+|  Add the entries that use a matching abbreviation in the table (see
+|  MatchMacros()) to `oneword'.  The macro words sort first.
+\* ----------------------------------------------------------------- */
+void FindMacros(Segment *seg, IndexTable *table)
+{
+    Word theabbrev;
+    WordCursor cur;
+    char *word, *number;
+    Index_t k;
+
+    if (!SeekBlock(&cur, table, 0))
+        return;
+    do {
+        if (*(word = cur.word) != MACRO_MARK)
+            break;
+        if (!(number = strchr(word, '=')))
+            continue;
+        strncpy(theabbrev, word + 1, number - word - 1);
+        theabbrev[number - word - 1] = 0;
+        k = FindAbbrev(theabbrev);
+        if ((k != INDEX_NAN) && macrofirst[k] &&
+                (strtoul(number + 1, NULL, 10) >= macrofirst[k]))
+            AddRefs(seg, &cur);
+    } while (NextWord(&cur));
+}
+
+/* ----------------------------------------------------------------- *\
+|  void FindInSegment(Segment *seg, char *word, char prefix, int macros)
+|
+|  Add the entries of one segment that have the word in the active
+|  field to `oneword', looking for the abbreviations that match it
+|  too if there are any.
+\* ----------------------------------------------------------------- */
+void FindInSegment(Segment *seg, char *word, char prefix, int macros)
+{
+    IndexTable *fieldtable = seg->fieldtable;
+    WordCursor cur;
+    int i, found;
+    char word_suffix[300], word_prefix[300];
+
+    if (seg->firstfield == -1)
+        return;
+
+    for (i = seg->firstfield; i <= seg->lastfield; i++) {
+        breakWord(word, word_prefix, word_suffix);
+
+        found = FindIndex(&cur, fieldtable + i, word_prefix, word_suffix,
+            word);
+        while (found) {
+            do {
+                AddRefs(seg, &cur);
+            } while (prefix && NextWord(&cur) &&
+                !strptrcmp(cur.word, word));
+
+            found = FindNextIndex(&cur, word_prefix, word_suffix, word);
+        }
+        if (macros)
+            FindMacros(seg, fieldtable + i);
     }
 }
 
@@ -1601,13 +2674,11 @@ static const char *const badwords[] = BADWORDS;
 |
 |  Find a word in the currently active field and update `results'.
 |  If the prefix flag is set, find all words having the given prefix.
+|  The entries found in all the segments are put together.
 \* ----------------------------------------------------------------- */
 void FindWord(register char *word, char prefix)
 {
-    register IndexPtr words;
-    Index_t win;
-    int i;
-    char word_suffix[300], word_prefix[300];
+    int i, k, macros;
 
     if (!prefix) {
         if (!word[0]) {
@@ -1632,36 +2703,243 @@ void FindWord(register char *word, char prefix)
 
     EmptySet(oneword);
 
-    for (i = firstfield; i <= lastfield; i++) {
-        words = fieldtable[i].words;
-        breakWord(word, word_prefix, word_suffix);
+    macros = MatchMacros(word);
+    for (k = 0; k < numsegments; k++)
+        FindInSegment(segments + k, word, prefix, macros);
 
-        win = FindIndex(fieldtable[i], word_prefix, word_suffix, word, prefix);
-        while (win != INDEX_NAN) {
-            do {
-                CachedList *clist = &(words[win].refs);
-                Index_t *p;
-
-                Access(clist, bixfp);
-                p = (Index_t *)safemalloc(clist->length * sizeof(Index_t),
-                    "Can't allocate entry list.", "");
-                UncompressRefs(p, clist->list, clist->length);
-                BuildSet(onefield, p, clist->length);
-                SetUnion(oneword, onefield, oneword);
-                free(p);
-            } while (prefix && ++win < fieldtable[i].numwords &&
-                !strptrcmp(words[win].theword, word));
-
-            win = FindNextIndex(fieldtable[i], word_prefix, word_suffix,
-                word, prefix, win);
+    SetIntersection(oneword, results, results);
+}
+
+/* ============================= OUTPUT ============================ */
+FILE *bibfp;                            /* NULL if it's a collection */
+
+#if HAVE_ZLIB
+#define FRAMECACHE 4                    /* inflated frames kept around */
+#define INCHUNK 16384                   /* compressed bytes read at once */
+
+typedef struct {            /* An inflated stretch of a gzip'ed bib */
+    Index_t frame;                      /* where it starts */
+    unsigned char *text;
+    FILE *fp;                           /* reads text, or NULL if unused */
+    unsigned long stamp;                /* when it was last used */
+} FrameSlot;
+
+FrameSlot framecache[FRAMECACHE];
+
+/* ----------------------------------------------------------------- *\
+|  long FrameReach(Index_t k)
+|
+|  Where the text that biblook might need from frame k ends: at the
+|  start of the first entry after the frame, or the end of the file.
+\* ----------------------------------------------------------------- */
+long FrameReach(Index_t k)
+{
+    Index_t lo = 0, hi = numoffsets, mid;
+    Off_t next;
+
+    if (k + 1 >= numframes)
+        return (long)framelength;
+    next = frames[k + 1].out;
+    while (lo < hi) {                   /* first offset at or after next */
+        mid = lo + (hi - lo) / 2;
+        if (offsets[mid] < next)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < numoffsets) ? (long)offsets[lo] : (long)framelength;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void InflateFrame(Index_t k, FrameSlot *slot)
+|
+|  Inflate the text from access point k up to its reach into slot.
+|  A point in the middle of a gzip member starts a raw deflate stream
+|  with the window as dictionary, maybe in the middle of a byte;
+|  either kind of stream may run on into the next member.
+\* ----------------------------------------------------------------- */
+void InflateFrame(Index_t k, FrameSlot *slot)
+{
+    FramePoint *pt = frames + k;
+    unsigned char input[INCHUNK];
+    unsigned char window[FRAME_WIN];
+    z_stream strm;
+    long length = FrameReach(k) - (long)pt->out;
+    int raw = !(pt->bits & FRAME_START);
+    int ch, ret, skip = 0;
+    size_t got;
+
+    if (length <= 0)
+        die("Index file is corrupt", "(bad frame table).");
+    slot->text = (unsigned char *)safemalloc((unsigned)length,
+        "Can't inflate", bibfile);
+
+    bzero(&strm, sizeof strm);
+    if (inflateInit2(&strm, raw ? -15 : 47) != Z_OK)
+        die("Can't inflate", bibfile);
+    if (fseek(bibfp, (long)pt->in - ((raw && pt->bits) ? 1 : 0), SEEK_SET))
+        pdie("Error reading", bibfile);
+    if (raw) {
+        if (pt->bits) {
+            ch = safegetc(bibfp) & 0xff;
+            (void)inflatePrime(&strm, pt->bits, ch >> (8 - pt->bits));
         }
+        if (fseek(framefp, pt->window, SEEK_SET))
+            pdie("Error reading", bixfile);
+        safefread((void *)window, 1, FRAME_WIN, framefp);
+        (void)inflateSetDictionary(&strm, window, FRAME_WIN);
     }
 
-    SetIntersection(oneword, results, results);
+    strm.next_out = slot->text;
+    strm.avail_out = (uInt)length;
+    while (strm.avail_out > 0) {
+        if (strm.avail_in == 0) {
+            got = fread(input, 1, INCHUNK, bibfp);
+            if (got == 0)
+                die("Unexpected end of", bibfile);
+            strm.next_in = input;
+            strm.avail_in = (uInt)got;
+        }
+        if (skip) {                     /* the trailer of a raw member */
+            got = (strm.avail_in < (uInt)skip) ? strm.avail_in : skip;
+            strm.next_in += got;
+            strm.avail_in -= got;
+            skip -= got;
+            continue;
+        }
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            if (raw) {
+                skip = 8;
+                raw = 0;
+            }
+            (void)inflateReset2(&strm, 47);
+        } else if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+            die("Can't inflate", bibfile);
+        }
+    }
+    (void)inflateEnd(&strm);
+
+    slot->frame = k;
+    slot->fp = fmemopen(slot->text, (size_t)length, "r");
+    if (!slot->fp)
+        pdie("Can't inflate", bibfile);
 }
 
-/* ============================= OUTPUT ============================ */
-FILE *bibfp;
+/* ----------------------------------------------------------------- *\
+|  FILE *SeekFrame(Off_t offset)
+|
+|  Get a stream that reads the gzip'ed bib file from offset, inflating
+|  the frame that offset falls in unless it is one of the FRAMECACHE
+|  most recently used ones.
+\* ----------------------------------------------------------------- */
+FILE *SeekFrame(Off_t offset)
+{
+    static unsigned long clock = 0;
+    FrameSlot *slot, *victim;
+    Index_t lo = 0, hi = numframes - 1, mid;
+    int i;
+
+    while (lo < hi) {                   /* last point at or before offset */
+        mid = lo + (hi - lo + 1) / 2;
+        if (frames[mid].out <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    victim = framecache;
+    for (i = 0, slot = framecache; i < FRAMECACHE; i++, slot++) {
+        if (slot->fp && (slot->frame == lo))
+            break;
+        if (!slot->fp || (victim->fp && (slot->stamp < victim->stamp)))
+            victim = slot;
+    }
+    if (i == FRAMECACHE) {
+        slot = victim;
+        if (slot->fp) {
+            fclose(slot->fp);
+            free(slot->text);
+            slot->fp = NULL;
+        }
+        InflateFrame(lo, slot);
+    }
+    slot->stamp = ++clock;
+
+    if (fseek(slot->fp, (long)(offset - frames[lo].out), SEEK_SET))
+        die("Index file is corrupt.", "");
+    return slot->fp;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void FreeFrameCache(VOID)
+|
+|  Free the inflated frames.
+\* ----------------------------------------------------------------- */
+void FreeFrameCache(VOID)
+{
+    int i;
+
+    for (i = 0; i < FRAMECACHE; i++) {
+        if (framecache[i].fp) {
+            fclose(framecache[i].fp);
+            free(framecache[i].text);
+            framecache[i].fp = NULL;
+        }
+    }
+}
+#endif /* HAVE_ZLIB */
+
+/* ----------------------------------------------------------------- *\
+|  FILE *SeekEntry(int entry)
+|
+|  Get ready to read the entry from the bib file, or, in a collection,
+|  from its own file, which is found by binary search.  At most
+|  MAXOPENBIBS files of a collection are kept open at a time.  A
+|  gzip'ed bib file is read through an inflated frame instead.
+\* ----------------------------------------------------------------- */
+FILE *SeekEntry(int entry)
+{
+    static int opened[MAXOPENBIBS];     /* the open ones, oldest first */
+    static int numopen = 0;
+    FILE *fp = bibfp;
+    int lo, hi, mid;
+
+#if HAVE_ZLIB
+    if (frames)
+        return SeekFrame(offsets[entry]);
+#endif /* HAVE_ZLIB */
+
+    if (nummembers) {
+        lo = 0;
+        hi = nummembers - 1;
+        while (lo < hi) {
+            mid = (lo + hi + 1) / 2;
+            if (members[mid].first <= (Index_t)entry)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+
+        if (!members[lo].fp) {
+            if (numopen == MAXOPENBIBS) {
+                fclose(members[opened[0]].fp);
+                members[opened[0]].fp = NULL;
+                memmove(opened, opened + 1, --numopen * sizeof(int));
+            }
+            members[lo].fp = fopen(members[lo].name, "r");
+            if (!members[lo].fp)
+                pdie("Can't read", members[lo].name);
+            opened[numopen++] = lo;
+        }
+        fp = members[lo].fp;
+        strcpy(bibfile, members[lo].name);      /* for safegetc() */
+    }
+
+    if (fseek(fp, offsets[entry], 0))
+        die("Index file is corrupt.", "");
+    return fp;
+}
 
 /* ----------------------------------------------------------------- *\
 |  void ReportResults(void)
@@ -1690,6 +2968,7 @@ void ReportResults(VOID)
 \* ----------------------------------------------------------------- */
 void PrintEntry(int entry, FILE *ofp)
 {
+    FILE *ifp;
     char ch;
     char braces;
     char quotes;
@@ -1698,25 +2977,24 @@ void PrintEntry(int entry, FILE *ofp)
         return;
 
     putc('\n', ofp);
-    if (fseek(bibfp, offsets[entry], 0))
-        die("Index file is corrupt.", "");
+    ifp = SeekEntry(entry);
 
-    ch = safegetc(bibfp);
+    ch = safegetc(ifp);
 
     while (ch != '@') {
         putc(ch, ofp);
-        ch = safegetc(bibfp);
+        ch = safegetc(ifp);
     }
 
     while ((ch != '{') && (ch != '(')) {
         putc(ch, ofp);
-        ch = safegetc(bibfp);
+        ch = safegetc(ifp);
     }
 
     braces = quotes = 0;
 
     putc(ch, ofp);
-    ch = safegetc(bibfp);
+    ch = safegetc(ifp);
     while (braces || quotes || ((ch != '}') && (ch != ')'))) {
         if (ch == '{')
             braces++;
@@ -1725,7 +3003,7 @@ void PrintEntry(int entry, FILE *ofp)
         else if ((ch == '"') && !braces)
             quotes = !quotes;
         putc(ch, ofp);
-        ch = safegetc(bibfp);
+        ch = safegetc(ifp);
     }
 
     putc(ch, ofp);
@@ -1843,10 +3121,9 @@ void extract_quotes(char source[], char sub[], int size)
     if (ptr) {
         from = ptr - source + 1;
 
-        /* determine end string */
+        /* determine end string (all of it, if the quote isn't closed) */
+        to = from + size - 1;
         ptr = strchr(ptr + 1, '"');
-        if (!ptr)
-            to = from + size - 1;
 
          /* treat escape characters */
         while (ptr && (ptr - source) < max_length) {
@@ -1956,10 +3233,7 @@ void TableEntry(int init, FILE *ofp)
     if (init >= (int)numoffsets)       /* extra bits might be set */
         return;
 
-    if (fseek(bibfp, offsets[init], 0))
-        die("Index file is corrupt.", "");
-
-    get_entry(entry, bibfp, MAX_CHAR_ARRAY);
+    get_entry(entry, SeekEntry(init), MAX_CHAR_ARRAY);
     clean_entry(entry);
     putc('\n', ofp);
 
@@ -3030,6 +4304,7 @@ int main(int argc, char **argv)
     char gotit;
     struct stat bibstat, bixstat;
     char *p;
+    int i;
 
     CopyrightBanner();
     (void)printf("For details, type @.\n");
@@ -3041,6 +4316,11 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if (((p = strrchr(argv[1], '.')) != (char *)NULL) &&
+            (strcmp(p, ".gz") == 0) && (p - argv[1] >= 4) &&
+            (strncmp(p - 4, ".bib", 4) == 0)) {
+        *p = '\0'; /* remove any .gz extension */
+    }
     if (((p = strrchr(argv[1], '.')) != (char *)NULL) &&
             (strcmp(p, ".bib") == 0)) {
         *p = '\0'; /* remove any .bib extension */
@@ -3071,11 +4351,11 @@ int main(int argc, char **argv)
                 (void)sprintf(bixfile, "%s.bix", argv[1]);
             }
 
-            if (stat(bibfile, &bibstat) != 0) {
-                if (errno != ENOENT)
-                    pdie("Can't open", bibfile);
-            } else {
+            if ((stat(bibfile, &bibstat) == 0) ||
+                    (stat(bixfile, &bixstat) == 0)) {   /* a collection? */
                 gotit = 1;
+            } else if (errno != ENOENT) {
+                pdie("Can't open", bibfile);
             }
 
             if (tmp != NULL)
@@ -3090,28 +4370,47 @@ int main(int argc, char **argv)
 
     /* ---- Now that we've found the files, open them and do the job ---- */
 
-    if (stat(bibfile, &bibstat) != 0)
-        pdie("Can't open", bibfile);
-
-    if (stat(bixfile, &bixstat) != 0)
+    if (stat(bixfile, &bixstat) != 0) {
+        if (stat(bibfile, &bibstat) != 0)
+            pdie("Can't open", bibfile);
         pdie("Can't open", bixfile);
+    }
 
-    if (bibstat.st_mtime > bixstat.st_mtime)
-        die(bixfile, "is out of date.\n\tPlease rerun bibindex.");
+    usemaps = (getenv("BIBLOOKNOMAP") == NULL);
+    GetTables();
 
-    bibfp = fopen(bibfile, "r");
-    if (!bibfp)
-        pdie("Can't read", bibfile);
-#if MSDOS
-    bixfp = fopen(bixfile, "rb");
-#else
-    bixfp = fopen(bixfile, "r");
-#endif
-    if (!bixfp)
-        pdie("Can't read", bixfile);
+    /* ---- The newest segment was written when the index was ---- */
+
+    if (fstat(fileno(segments[numsegments - 1].fp), &bixstat) != 0)
+        pdie("Can't open", segments[numsegments - 1].filename);
+
+    if (nummembers) {
+        bibfp = NULL;
+        for (i = 0; i < nummembers; i++) {
+            if (stat(members[i].name, &bibstat) != 0)
+                pdie("Can't open", members[i].name);
+            if (bibstat.st_mtime > bixstat.st_mtime)
+                die(bixfile, "is out of date.\n\tPlease rerun bibindex.");
+        }
+    } else {
+        if (frames && (stat(bibfile, &bibstat) != 0))
+            strcat(bibfile, ".gz");     /* the bib is gzip'ed */
+#if !HAVE_ZLIB
+        if (frames)
+            die("Can't read gzip'ed files like", bibfile);
+#endif /* !HAVE_ZLIB */
+        if (stat(bibfile, &bibstat) != 0)
+            pdie("Can't open", bibfile);
+        if (bibstat.st_mtime > bixstat.st_mtime)
+            die(bixfile, "is out of date.\n\tPlease rerun bibindex.");
+
+        bibfp = fopen(bibfile, "r");
+        if (!bibfp)
+            pdie("Can't read", bibfile);
+    }
 
-    GetTables();
     InitSearch();
+    InitStreamTables();
 
     History_init();
 
@@ -3136,7 +4435,10 @@ int main(int argc, char **argv)
     FreeSearch();
     FreeTables();
 
-    fclose(bibfp);
-    fclose(bixfp);
+#if HAVE_ZLIB
+    FreeFrameCache();
+#endif /* HAVE_ZLIB */
+    if (bibfp)
+        fclose(bibfp);
     return (0);
 }
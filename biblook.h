@@ -58,6 +58,7 @@ Software Foundation, 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <time.h>
 #include <errno.h>
 #include <limits.h>
+#include <setjmp.h>
 
 #ifndef FILENAME_MAX	  /* defined in all Standard C implementations */
 #define FILENAME_MAX 1024 /* else use common UNIX value */
@@ -89,6 +90,8 @@ typedef int int32;
 typedef unsigned long uint32;
 typedef long int32;
 #endif
+typedef unsigned long long uint64;
+typedef long long int64;
 
 /* ==================== Machine-specific definitions =================== */
 #ifndef MOREPATH				 /* can override at compile time */
@@ -121,11 +124,32 @@ extern "C"
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <utime.h>
+#include <dirent.h>
 #if HAVE_MALLOC_H
 #include <malloc.h>
 #endif /* HAVE_MALLOC_H */
+#if HAVE_MMAP
+#include <sys/mman.h>
+#endif /* HAVE_MMAP */
+#if HAVE_FSYNC
+#include <fcntl.h>
+#endif /* HAVE_FSYNC */
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif /* HAVE_PTHREAD */
 #endif /* __NeXT__ */
 
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+
+/* SSSE3 intrinsics for decoding reference lists (scalar code
+   otherwise) */
+#if __SSSE3__
+#include <tmmintrin.h>
+#endif /* __SSSE3__ */
+
 #if (__STDC__ || __cplusplus || c_plusplus)
 #define VOID void
 #else /* NOT (__STDC__ || __cplusplus || c_plusplus) */
@@ -251,20 +275,28 @@ extern "C"
 
     /* ====================== Program-specific stuff ====================== */
 
-#define FILE_VERSION 4	/* file format version */
-#define MAJOR_VERSION 2 /* program version     */
-#define MINOR_VERSION 11
+#define FILE_VERSION 10	/* file format version */
+#define OLD_VERSION 4	/* oldest version biblook still reads */
+#define ORDER_MARK 0x01020304UL	 /* after the header line of a */
+#define NATIVE_MARK 0x0a0b0c0dUL /* portable or a native index */
+#define MAJOR_VERSION 3 /* program version     */
+#define MINOR_VERSION 0
 
-#define MAXWORD 31	   /* maximum length of word indexed */
+#define MAXWORD 63	   /* maximum length of word indexed */
 #define MAXSTRING 4095 /* maximum length of line handled */
 typedef char Word[MAXWORD + 1];
 typedef char String[MAXSTRING + 1];
 
-typedef uint16 Index_s;				  /* refs per word */
+typedef uint16 Index_s;				  /* small counts, in version 4 */
 typedef uint32 Index_t;				  /* entries per file */
-typedef int32 Off_t;				  /* .bix file offsets */
+typedef int64 Off_t;				  /* .bib file offsets */
 #define INDEX_NAN (Index_t) - 1		  /* "no such index" */
 #define INDEX_BUILTIN (INDEX_NAN - 1) /* used for builtin abbrevs */
+#define MACRO_MARK '\001'			  /* starts words for abbrev uses */
+
+#define CODEC_VARINT 0	/* reference lists as deltas, seven bits a byte */
+#define CODEC_STREAM 1	/* in blocks of REFBLOCK, with skips; see bibindex */
+#define REFBLOCK 128	/* references per block */
 
 /*
  * bibindex ignores single letter words automagically. so we omit